@@ -2,10 +2,19 @@
 #include <string>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
 class MessengerClient {
 private:
@@ -15,6 +24,9 @@ private:
     std::string username;
     std::atomic<bool> running;
     std::thread receive_thread;
+    std::vector<std::thread> transfer_threads;
+    std::string upload_key;          // issued by the server at login
+    std::mutex upload_key_mutex;
 
 public:
     MessengerClient(const std::string& server_ip, int server_port, const std::string& username)
@@ -84,6 +96,14 @@ public:
             receive_thread.join();
         }
 
+        // Let running transfers finish on their own connections
+        for (auto& thread : transfer_threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+        transfer_threads.clear();
+
         std::cout << "Disconnected from server" << std::endl;
     }
 
@@ -119,6 +139,20 @@ public:
                 break;
             }
 
+            // Transfers run on their own connection so chat keeps flowing
+            if (message.compare(0, 8, "/upload ") == 0) {
+                transfer_threads.push_back(std::thread(&MessengerClient::upload_file, this, message.substr(8)));
+                continue;
+            }
+            if (message.compare(0, 10, "/download ") == 0) {
+                std::istringstream args(message.substr(10));
+                std::string hash;
+                std::string path;
+                args >> hash >> path;
+                transfer_threads.push_back(std::thread(&MessengerClient::download_file, this, hash, path));
+                continue;
+            }
+
             if (!message.empty()) {
                 std::cout << "You: " << message << std::endl;
                 if (!send_message(message)) {
@@ -132,6 +166,133 @@ public:
     }
 
 private:
+    int open_transfer_connection() {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == -1) {
+            return -1;
+        }
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(server_port);
+        if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0 ||
+            ::connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    // Reads one '\n'-terminated reply without consuming any payload after it
+    static std::string read_line(int sock) {
+        std::string line;
+        char c;
+        while (recv(sock, &c, 1, 0) == 1 && c != '\n') {
+            line.push_back(c);
+        }
+        return line;
+    }
+
+    // Uploads with sendfile and resumes from the offset the server reports.
+    // The token is derived from the file identity so a retry picks up the partial upload.
+    void upload_file(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+            std::cerr << "Cannot upload " << path << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+
+        char token[17];
+        snprintf(token, sizeof(token), "%016zx",
+                 std::hash<std::string>()(path + ":" + std::to_string(info.st_size) + ":" +
+                                          std::to_string(info.st_mtime)));
+
+        std::string key;
+        {
+            std::lock_guard<std::mutex> lock(upload_key_mutex);
+            key = upload_key;
+        }
+        int sock = key.empty() ? -1 : open_transfer_connection();
+        if (sock < 0) {
+            std::cerr << "Upload connection failed" << std::endl;
+            close(fd);
+            return;
+        }
+
+        std::string header = "/upload " + key + " " + std::string(token) + " " + std::to_string(info.st_size) + "\n";
+        send(sock, header.c_str(), header.length(), 0);
+        std::string reply = read_line(sock);
+        if (reply.compare(0, 7, "OFFSET ") == 0) {
+            off_t offset = std::stoll(reply.substr(7));
+            while (offset < info.st_size) {
+                if (sendfile(sock, fd, &offset, info.st_size - offset) <= 0) {
+                    break;
+                }
+            }
+            reply = read_line(sock);
+        }
+
+        if (reply.compare(0, 3, "OK ") == 0) {
+            std::string hash = reply.substr(3);
+            std::cout << "Uploaded " << path << " as " << hash << std::endl;
+            std::string name = path.substr(path.find_last_of('/') + 1);
+            send_message("/share " + hash + " " + name);
+        } else {
+            std::cerr << "Upload of " << path << " failed: " << reply << std::endl;
+        }
+        close(sock);
+        close(fd);
+    }
+
+    // Appends to an existing partial file, so a rerun resumes the download
+    void download_file(const std::string& hash, const std::string& path) {
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        int sock = fd >= 0 ? open_transfer_connection() : -1;
+        if (sock < 0) {
+            std::cerr << "Cannot download " << hash << " to " << path << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+
+        off_t offset = lseek(fd, 0, SEEK_END);
+        std::string header = "/download " + hash + " " + std::to_string(offset) + "\n";
+        send(sock, header.c_str(), header.length(), 0);
+
+        std::string reply = read_line(sock);
+        uint64_t total = 0, start = 0, remaining = 0;
+        std::istringstream fields(reply);
+        std::string tag;
+        fields >> tag >> total >> start >> remaining;
+        if (tag != "SIZE") {
+            std::cerr << "Download of " << hash << " failed: " << reply << std::endl;
+            remaining = 0;
+        }
+
+        char buffer[64 * 1024];
+        while (remaining > 0) {
+            ssize_t n = recv(sock, buffer, std::min<uint64_t>(remaining, sizeof(buffer)), 0);
+            if (n <= 0 || write(fd, buffer, n) != n) {
+                break;
+            }
+            remaining -= n;
+        }
+        if (tag == "SIZE") {
+            if (remaining == 0) {
+                std::cout << "Downloaded " << hash << " to " << path << std::endl;
+            } else {
+                std::cerr << "Download of " << hash << " interrupted, run it again to resume" << std::endl;
+            }
+        }
+        close(sock);
+        close(fd);
+    }
+
     void receive_messages() {
         char buffer[1024];
         
@@ -153,7 +314,17 @@ private:
                 break;
             } else {
                 buffer[bytes_read] = '\0';
-                std::cout << buffer << std::endl;
+                char* text = buffer;
+                // The first line after login carries the key for uploads
+                if (strncmp(text, "[upload-key] ", 13) == 0) {
+                    char* end = strchr(text, '\n');
+                    std::lock_guard<std::mutex> lock(upload_key_mutex);
+                    upload_key.assign(text + 13, end ? end - text - 13 : strlen(text + 13));
+                    text = end ? end + 1 : text + strlen(text);
+                }
+                if (*text) {
+                    std::cout << text << std::endl;
+                }
             }
         }
     }
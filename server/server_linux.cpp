@@ -4,28 +4,1873 @@
 #include <map>
 #include <thread>
 #include <mutex>
+#include <memory>
+#include <set>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <cctype>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <random>
+#include <unordered_map>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <system_error>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+// Token bucket refilled lazily on every take. Tokens are kept in millionths so
+// the integer refill does not lose precision at low rates. The state is two
+// atomics, so a bucket shared between sessions (per-IP) needs no lock.
+class TokenBucket {
+private:
+    static constexpr int64_t SCALE = 1000000;
+
+    std::atomic<int64_t> tokens;
+    std::atomic<int64_t> last_refill; // steady_clock nanoseconds
+    double rate_per_ns;               // scaled tokens per nanosecond
+    int64_t capacity;
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    TokenBucket(double rate_per_sec, double burst)
+        : tokens(static_cast<int64_t>(burst * SCALE)),
+          last_refill(now_ns()),
+          rate_per_ns(rate_per_sec * SCALE / 1e9),
+          capacity(static_cast<int64_t>(burst * SCALE)) {}
+
+    bool try_take() {
+        // Only the thread that advances last_refill credits the elapsed time
+        int64_t now = now_ns();
+        int64_t last = last_refill.load(std::memory_order_relaxed);
+        int64_t refill = 0;
+        if (now > last && last_refill.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+            refill = static_cast<int64_t>(std::min(static_cast<double>(capacity), (now - last) * rate_per_ns));
+        }
+
+        int64_t current = tokens.load(std::memory_order_relaxed);
+        while (true) {
+            int64_t next = std::min(current + refill, capacity);
+            bool taken = next >= SCALE;
+            if (taken) {
+                next -= SCALE;
+            }
+            if (tokens.compare_exchange_weak(current, next, std::memory_order_relaxed)) {
+                return taken;
+            }
+        }
+    }
+
+    int64_t idle_ns() const {
+        return now_ns() - last_refill.load(std::memory_order_relaxed);
+    }
+};
+
+struct RateLimitConfig {
+    double session_rate = 5.0;       // messages per second per session
+    double session_burst = 20.0;
+    double ip_rate = 20.0;           // messages per second per source address
+    double ip_burst = 60.0;
+    double connect_rate = 1.0;       // new connections per second per source address
+    double connect_burst = 10.0;
+    int max_connections_per_ip = 16;
+    int max_violations = 50;         // consecutive dropped messages before disconnect
+    std::set<std::string> exempt_ips; // usernames are unauthenticated, so only addresses are exempted
+};
+
+// Per-session and per-source-address flood protection. Address state is looked
+// up once at accept time; the receive path only touches the buckets.
+class RateLimiter {
+public:
+    struct AddressState {
+        TokenBucket messages;
+        TokenBucket connects;
+        std::atomic<int> connections;
+        bool exempt;
+
+        AddressState(const RateLimitConfig& config, bool exempt)
+            : messages(config.ip_rate, config.ip_burst),
+              connects(config.connect_rate, config.connect_burst),
+              connections(0), exempt(exempt) {}
+    };
+
+    // Owned by a single client thread, so only the shared address bucket contends
+    struct Session {
+        std::shared_ptr<AddressState> address;
+        TokenBucket messages;
+        bool exempt;
+        int violations;
+
+        Session(const RateLimiter& limiter, std::shared_ptr<AddressState> address)
+            : address(std::move(address)),
+              messages(limiter.config.session_rate, limiter.config.session_burst),
+              exempt(this->address->exempt),
+              violations(0) {}
+    };
+
+    enum class Verdict { Allow, Drop, Disconnect };
+
+    std::atomic<uint64_t> messages_allowed{0};
+    std::atomic<uint64_t> messages_dropped{0};
+    std::atomic<uint64_t> connections_rejected{0};
+    std::atomic<uint64_t> sessions_disconnected{0};
+
+private:
+    static constexpr size_t PRUNE_THRESHOLD = 4096;
+    static constexpr int64_t PRUNE_IDLE_NS = 60LL * 1000000000LL;
+
+    RateLimitConfig config;
+    std::map<std::string, std::shared_ptr<AddressState>> addresses;
+    std::mutex addresses_mutex;
+
+public:
+    explicit RateLimiter(const RateLimitConfig& config) : config(config) {}
+
+    // Returns nullptr when the address is over its connection limits
+    std::shared_ptr<AddressState> admit_connection(const std::string& ip) {
+        std::shared_ptr<AddressState> state;
+        {
+            std::lock_guard<std::mutex> lock(addresses_mutex);
+            if (addresses.size() > PRUNE_THRESHOLD) {
+                prune_idle();
+            }
+            auto& slot = addresses[ip];
+            if (!slot) {
+                slot = std::make_shared<AddressState>(config, config.exempt_ips.count(ip) > 0);
+            }
+            state = slot;
+        }
+
+        if (!state->exempt) {
+            if (!state->connects.try_take() ||
+                state->connections.load(std::memory_order_relaxed) >= config.max_connections_per_ip) {
+                connections_rejected.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+        }
+        state->connections.fetch_add(1, std::memory_order_relaxed);
+        return state;
+    }
+
+    void release_connection(const std::shared_ptr<AddressState>& state) {
+        state->connections.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    Verdict check_message(Session& session) {
+        if (session.exempt) {
+            messages_allowed.fetch_add(1, std::memory_order_relaxed);
+            return Verdict::Allow;
+        }
+        // Session bucket first so one noisy session cannot drain its neighbours' address budget
+        if (session.messages.try_take() && session.address->messages.try_take()) {
+            session.violations = 0;
+            messages_allowed.fetch_add(1, std::memory_order_relaxed);
+            return Verdict::Allow;
+        }
+        messages_dropped.fetch_add(1, std::memory_order_relaxed);
+        if (++session.violations >= config.max_violations) {
+            sessions_disconnected.fetch_add(1, std::memory_order_relaxed);
+            return Verdict::Disconnect;
+        }
+        return Verdict::Drop;
+    }
+
+    void print_stats() const {
+        std::cout << "Rate limiter: " << messages_allowed.load() << " allowed, "
+                  << messages_dropped.load() << " dropped, "
+                  << connections_rejected.load() << " connections rejected, "
+                  << sessions_disconnected.load() << " sessions disconnected" << std::endl;
+    }
+
+private:
+    // Caller holds addresses_mutex
+    void prune_idle() {
+        for (auto it = addresses.begin(); it != addresses.end();) {
+            const auto& state = it->second;
+            if (state->connections.load(std::memory_order_relaxed) == 0 &&
+                state->connects.idle_ns() > PRUNE_IDLE_NS &&
+                state->messages.idle_ns() > PRUNE_IDLE_NS) {
+                it = addresses.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+// Query accepted by SearchIndex::search. Empty fields match everything.
+struct SearchQuery {
+    std::vector<std::string> terms; // all must match
+    std::string user;
+    std::string room;
+    int64_t from_ms = 0;
+    int64_t to_ms = INT64_MAX;
+    size_t limit = 20;
+};
+
+struct SearchHit {
+    int64_t timestamp_ms;
+    std::string room;
+    std::string user;
+    std::string text;
+};
+
+// Incremental inverted index over the message history. Messages are queued by
+// the chat threads and indexed by a background thread into immutable segments;
+// posting lists are delta + varint encoded. Small segments are merged as they
+// accumulate, so a query touches O(log N) segments and never takes a lock held
+// by the indexer for longer than a vector copy.
+class SearchIndex {
+private:
+    struct Document {
+        int64_t timestamp_ms;
+        std::string room;
+        std::string user;
+        std::string text;
+    };
+
+    struct Segment {
+        std::vector<Document> docs; // ordered by time
+        std::unordered_map<std::string, std::string> postings; // term -> encoded local doc indices
+    };
+
+    static constexpr size_t SEAL_DOCS = 1024;
+    static constexpr size_t MAX_MERGE_DOCS = 1 << 20;
+    static constexpr size_t MAX_PENDING = 1 << 20;
+    static constexpr size_t MAX_TERM_LENGTH = 64;
+
+    std::string history_path;
+    std::ofstream history;
+
+    std::vector<Document> pending;
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    bool stopping;
+    std::chrono::steady_clock::time_point stop_deadline;
+    std::atomic<uint64_t> dropped{0};
+
+    std::vector<std::shared_ptr<const Segment>> segments; // oldest first
+    mutable std::mutex segments_mutex;
+
+    std::thread indexer;
+
+public:
+    // The existing history is reloaded on the indexer thread; messages added
+    // meanwhile queue up and are indexed after it, so startup never waits on it.
+    explicit SearchIndex(const std::string& history_path) : history_path(history_path), stopping(false) {
+        history.open(history_path, std::ios::app);
+        if (!history) {
+            std::cerr << "Failed to open history file " << history_path << std::endl;
+        }
+        indexer = std::thread(&SearchIndex::run, this);
+    }
+
+    ~SearchIndex() {
+        stop();
+    }
+
+    // Indexes whatever is still queued, then stops the indexer. Past the
+    // deadline, queued messages are only appended to the history file; the
+    // next startup indexes them from there. No new merges start once stopping,
+    // but a merge already running finishes before the indexer exits.
+    void stop(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            stopping = true;
+            stop_deadline = deadline;
+        }
+        pending_cv.notify_one();
+        if (indexer.joinable()) {
+            indexer.join();
+        }
+    }
+
+    // Called on the chat path: one short critical section, no indexing work
+    void add(const std::string& room, const std::string& user, const std::string& text) {
+        Document doc{now_ms(), room, user, text};
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            if (stopping || pending.size() >= MAX_PENDING) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            pending.push_back(std::move(doc));
+        }
+        pending_cv.notify_one();
+    }
+
+    // Newest matches first
+    std::vector<SearchHit> search(const SearchQuery& query) const {
+        std::vector<std::shared_ptr<const Segment>> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(segments_mutex);
+            snapshot = segments;
+        }
+
+        std::vector<std::string> required;
+        for (const auto& term : query.terms) {
+            for (auto& token : tokenize(term)) {
+                required.push_back(std::move(token));
+            }
+        }
+        if (!query.user.empty()) {
+            required.push_back(user_term(query.user));
+        }
+        if (!query.room.empty()) {
+            required.push_back(room_term(query.room));
+        }
+
+        std::vector<SearchHit> hits;
+        for (auto it = snapshot.rbegin(); it != snapshot.rend() && hits.size() < query.limit; ++it) {
+            const Segment& segment = **it;
+            if (segment.docs.empty() ||
+                segment.docs.front().timestamp_ms > query.to_ms ||
+                segment.docs.back().timestamp_ms < query.from_ms) {
+                continue;
+            }
+
+            std::vector<uint32_t> matches = match_segment(segment, required);
+            for (auto m = matches.rbegin(); m != matches.rend() && hits.size() < query.limit; ++m) {
+                const Document& doc = segment.docs[*m];
+                if (doc.timestamp_ms >= query.from_ms && doc.timestamp_ms <= query.to_ms) {
+                    hits.push_back({doc.timestamp_ms, doc.room, doc.user, doc.text});
+                }
+            }
+        }
+        return hits;
+    }
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    void run() {
+        load_history();
+
+        std::vector<Document> batch;
+        while (true) {
+            bool persist_only = false;
+            {
+                std::unique_lock<std::mutex> lock(pending_mutex);
+                // Seal on size, or after a short delay so new messages become searchable quickly
+                pending_cv.wait_for(lock, std::chrono::milliseconds(200),
+                                    [this] { return stopping || pending.size() >= SEAL_DOCS; });
+                batch.swap(pending);
+                if (batch.empty() && stopping) {
+                    break;
+                }
+                persist_only = stopping && std::chrono::steady_clock::now() >= stop_deadline;
+            }
+            if (batch.empty()) {
+                continue;
+            }
+
+            for (const auto& doc : batch) {
+                append_history(doc);
+            }
+            history.flush();
+            if (persist_only) {
+                batch.clear();
+                continue;
+            }
+
+            for (size_t offset = 0; offset < batch.size(); offset += SEAL_DOCS) {
+                size_t end = std::min(batch.size(), offset + SEAL_DOCS);
+                publish(build_segment(std::vector<Document>(
+                    std::make_move_iterator(batch.begin() + offset),
+                    std::make_move_iterator(batch.begin() + end))));
+            }
+            batch.clear();
+        }
+        if (dropped.load() > 0) {
+            std::cerr << "Search index dropped " << dropped.load() << " messages" << std::endl;
+        }
+    }
+
+    void publish(std::shared_ptr<const Segment> segment) {
+        {
+            std::lock_guard<std::mutex> lock(segments_mutex);
+            segments.push_back(std::move(segment));
+        }
+
+        // Merge the newest segments while they are no bigger than their predecessor,
+        // which keeps the segment count logarithmic in the number of documents.
+        // Only this thread mutates the list, so reading it here without the lock is safe.
+        // Merging only speeds up queries, so it is skipped once stop() has been called.
+        while (segments.size() >= 2 && !is_stopping()) {
+            const auto& older = segments[segments.size() - 2];
+            const auto& newer = segments.back();
+            size_t merged_size = older->docs.size() + newer->docs.size();
+            if (older->docs.size() > newer->docs.size() || merged_size > MAX_MERGE_DOCS) {
+                break;
+            }
+            auto merged = merge_segments(*older, *newer);
+            std::lock_guard<std::mutex> lock(segments_mutex);
+            segments.pop_back();
+            segments.back() = std::move(merged);
+        }
+    }
+
+    bool is_stopping() {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        return stopping;
+    }
+
+    static std::shared_ptr<const Segment> build_segment(std::vector<Document> docs) {
+        auto segment = std::make_shared<Segment>();
+        std::unordered_map<std::string, std::vector<uint32_t>> lists;
+        for (uint32_t i = 0; i < docs.size(); ++i) {
+            auto add_term = [&](const std::string& term) {
+                auto& list = lists[term];
+                if (list.empty() || list.back() != i) {
+                    list.push_back(i);
+                }
+            };
+            for (const auto& token : tokenize(docs[i].text)) {
+                add_term(token);
+            }
+            add_term(user_term(docs[i].user));
+            add_term(room_term(docs[i].room));
+        }
+        for (const auto& entry : lists) {
+            segment->postings.emplace(entry.first, encode(entry.second));
+        }
+        segment->docs = std::move(docs);
+        return segment;
+    }
+
+    static std::shared_ptr<const Segment> merge_segments(const Segment& older, const Segment& newer) {
+        auto merged = std::make_shared<Segment>();
+        merged->docs.reserve(older.docs.size() + newer.docs.size());
+        merged->docs.insert(merged->docs.end(), older.docs.begin(), older.docs.end());
+        merged->docs.insert(merged->docs.end(), newer.docs.begin(), newer.docs.end());
+
+        // Doc indices in the newer segment shift by the older segment's size
+        merged->postings = older.postings;
+        uint32_t shift = static_cast<uint32_t>(older.docs.size());
+        for (const auto& entry : newer.postings) {
+            std::vector<uint32_t> list = decode(entry.second);
+            for (auto& index : list) {
+                index += shift;
+            }
+            auto existing = merged->postings.find(entry.first);
+            if (existing == merged->postings.end()) {
+                merged->postings.emplace(entry.first, encode(list));
+            } else {
+                std::vector<uint32_t> combined = decode(existing->second);
+                combined.insert(combined.end(), list.begin(), list.end());
+                existing->second = encode(combined);
+            }
+        }
+        return merged;
+    }
+
+    static std::vector<uint32_t> match_segment(const Segment& segment, const std::vector<std::string>& required) {
+        std::vector<uint32_t> result;
+        if (required.empty()) {
+            result.resize(segment.docs.size());
+            for (uint32_t i = 0; i < result.size(); ++i) {
+                result[i] = i;
+            }
+            return result;
+        }
+
+        // Intersect starting from the shortest list
+        std::vector<const std::string*> lists;
+        for (const auto& term : required) {
+            auto it = segment.postings.find(term);
+            if (it == segment.postings.end()) {
+                return result;
+            }
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(),
+                  [](const std::string* a, const std::string* b) { return a->size() < b->size(); });
+
+        result = decode(*lists[0]);
+        for (size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+            std::vector<uint32_t> other = decode(*lists[i]);
+            std::vector<uint32_t> both;
+            std::set_intersection(result.begin(), result.end(), other.begin(), other.end(),
+                                  std::back_inserter(both));
+            result.swap(both);
+        }
+        return result;
+    }
+
+    static std::string encode(const std::vector<uint32_t>& list) {
+        std::string out;
+        uint32_t previous = 0;
+        for (uint32_t value : list) {
+            uint32_t delta = value - previous;
+            previous = value;
+            while (delta >= 0x80) {
+                out.push_back(static_cast<char>((delta & 0x7F) | 0x80));
+                delta >>= 7;
+            }
+            out.push_back(static_cast<char>(delta));
+        }
+        return out;
+    }
+
+    static std::vector<uint32_t> decode(const std::string& data) {
+        std::vector<uint32_t> list;
+        uint32_t value = 0;
+        uint32_t delta = 0;
+        int shift = 0;
+        for (unsigned char byte : data) {
+            delta |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            if (byte & 0x80) {
+                shift += 7;
+                continue;
+            }
+            value += delta;
+            list.push_back(value);
+            delta = 0;
+            shift = 0;
+        }
+        return list;
+    }
+
+    // Lowercased runs of letters and digits; non-ASCII bytes count as letters
+    static std::vector<std::string> tokenize(const std::string& text) {
+        std::vector<std::string> tokens;
+        std::string current;
+        for (unsigned char c : text) {
+            if (std::isalnum(c) || c >= 0x80) {
+                current.push_back(static_cast<char>(std::tolower(c)));
+            } else if (!current.empty()) {
+                if (current.size() <= MAX_TERM_LENGTH) {
+                    tokens.push_back(current);
+                }
+                current.clear();
+            }
+        }
+        if (!current.empty() && current.size() <= MAX_TERM_LENGTH) {
+            tokens.push_back(current);
+        }
+        return tokens;
+    }
+
+    // Users and rooms are indexed as terms that tokenize() can never produce
+    static std::string user_term(const std::string& user) {
+        return "\x01u" + lowercase(user);
+    }
+
+    static std::string room_term(const std::string& room) {
+        return "\x01r" + lowercase(room);
+    }
+
+    static std::string lowercase(std::string text) {
+        std::transform(text.begin(), text.end(), text.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return text;
+    }
+
+    // History file format: timestamp_ms \t room \t user \t text, one message per line
+    void append_history(const Document& doc) {
+        if (!history) {
+            return;
+        }
+        history << doc.timestamp_ms << '\t' << escape(doc.room) << '\t'
+                << escape(doc.user) << '\t' << escape(doc.text) << '\n';
+    }
+
+    // Runs on the indexer thread before any new document is appended
+    void load_history() {
+        std::ifstream in(history_path);
+        if (!in) {
+            return;
+        }
+        std::vector<Document> docs;
+        std::string line;
+        while (std::getline(in, line)) {
+            std::vector<std::string> fields;
+            size_t start = 0;
+            for (int i = 0; i < 3; ++i) {
+                size_t tab = line.find('\t', start);
+                if (tab == std::string::npos) {
+                    break;
+                }
+                fields.push_back(line.substr(start, tab - start));
+                start = tab + 1;
+            }
+            if (fields.size() != 3) {
+                continue;
+            }
+            docs.push_back({std::atoll(fields[0].c_str()), unescape(fields[1]),
+                            unescape(fields[2]), unescape(line.substr(start))});
+            if (docs.size() == SEAL_DOCS) {
+                publish(build_segment(std::move(docs)));
+                docs.clear();
+                // A shutdown during a long reload skips the rest; the file itself is intact
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                if (stopping) {
+                    return;
+                }
+            }
+        }
+        if (!docs.empty()) {
+            publish(build_segment(std::move(docs)));
+        }
+    }
+
+    static std::string escape(const std::string& text) {
+        std::string out;
+        for (char c : text) {
+            switch (c) {
+                case '\\': out += "\\\\"; break;
+                case '\t': out += "\\t"; break;
+                case '\n': out += "\\n"; break;
+                case '\r': out += "\\r"; break;
+                default: out.push_back(c);
+            }
+        }
+        return out;
+    }
+
+    static std::string unescape(const std::string& text) {
+        std::string out;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] != '\\' || i + 1 == text.size()) {
+                out.push_back(text[i]);
+                continue;
+            }
+            switch (text[++i]) {
+                case 't': out.push_back('\t'); break;
+                case 'n': out.push_back('\n'); break;
+                case 'r': out.push_back('\r'); break;
+                default: out.push_back(text[i]);
+            }
+        }
+        return out;
+    }
+};
+
+// Online/away/typing status per room. Updates are coalesced per user and
+// published once per tick as a single batched diff per room, so a burst of
+// status changes in a large room costs one fan-out per interval. A status that
+// changes and reverts within one tick is never published.
+class PresenceService {
+public:
+    enum class Status { Offline, Online, Away, Typing };
+
+    // Delivers one diff line to every member of a room
+    using Publisher = std::function<void(const std::string& room, const std::string& diff)>;
+
+private:
+    struct RoomState {
+        std::unordered_map<std::string, Status> published;
+        std::unordered_map<std::string, Status> pending;
+        std::unordered_map<std::string, std::chrono::steady_clock::time_point> typing_expiry;
+        std::unordered_map<std::string, int> sessions; // a user may be connected more than once
+    };
+
+    std::chrono::milliseconds tick;
+    std::chrono::milliseconds typing_timeout;
+    Publisher publisher;
+
+    std::unordered_map<std::string, RoomState> rooms;
+    std::mutex rooms_mutex;
+    std::condition_variable stop_cv;
+    bool stopping;
+    std::thread ticker;
+
+public:
+    PresenceService(Publisher publisher,
+                    std::chrono::milliseconds tick = std::chrono::milliseconds(250),
+                    std::chrono::milliseconds typing_timeout = std::chrono::milliseconds(5000))
+        : tick(tick), typing_timeout(typing_timeout), publisher(std::move(publisher)), stopping(false) {
+        ticker = std::thread(&PresenceService::run, this);
+    }
+
+    ~PresenceService() {
+        stop();
+    }
+
+    // Publishes the last pending diffs and stops the ticker
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(rooms_mutex);
+            if (stopping) {
+                return;
+            }
+            stopping = true;
+        }
+        stop_cv.notify_one();
+        if (ticker.joinable()) {
+            ticker.join();
+        }
+    }
+
+    // A session entered the room; the user shows as online from the first one
+    void enter(const std::string& room, const std::string& user) {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        RoomState& state = rooms[room];
+        if (state.sessions[user]++ == 0) {
+            set_status(state, user, Status::Online);
+        }
+    }
+
+    // A session left the room; the user goes offline once their last one leaves
+    void leave(const std::string& room, const std::string& user) {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        auto room_it = rooms.find(room);
+        if (room_it == rooms.end()) {
+            return;
+        }
+        RoomState& state = room_it->second;
+        auto it = state.sessions.find(user);
+        if (it != state.sessions.end() && --it->second == 0) {
+            state.sessions.erase(it);
+            set_status(state, user, Status::Offline);
+        }
+    }
+
+    // Status change from a session already in the room
+    void update(const std::string& room, const std::string& user, Status status) {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        auto room_it = rooms.find(room);
+        if (room_it == rooms.end() || !room_it->second.sessions.count(user)) {
+            return;
+        }
+        set_status(room_it->second, user, status);
+    }
+
+    // Current published membership of a room, for clients that just joined it
+    std::string snapshot(const std::string& room) {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        std::string line = "[presence] #" + room;
+        auto it = rooms.find(room);
+        if (it != rooms.end()) {
+            for (const auto& entry : it->second.published) {
+                line += " " + entry.first + ":" + status_name(entry.second);
+            }
+        }
+        return line;
+    }
+
+    static const char* status_name(Status status) {
+        switch (status) {
+            case Status::Online: return "online";
+            case Status::Away: return "away";
+            case Status::Typing: return "typing";
+            default: return "offline";
+        }
+    }
+
+private:
+    // Caller holds rooms_mutex
+    void set_status(RoomState& state, const std::string& user, Status status) {
+        state.pending[user] = status;
+        if (status == Status::Typing) {
+            state.typing_expiry[user] = std::chrono::steady_clock::now() + typing_timeout;
+        } else {
+            state.typing_expiry.erase(user);
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(rooms_mutex);
+        while (true) {
+            bool last = stop_cv.wait_for(lock, tick, [this] { return stopping; });
+            std::vector<std::pair<std::string, std::string>> diffs = collect_diffs();
+
+            // Publish outside the lock so a slow fan-out does not stall updates
+            lock.unlock();
+            for (const auto& diff : diffs) {
+                publisher(diff.first, diff.second);
+            }
+            lock.lock();
+
+            if (last) {
+                break;
+            }
+        }
+    }
+
+    // Caller holds rooms_mutex
+    std::vector<std::pair<std::string, std::string>> collect_diffs() {
+        std::vector<std::pair<std::string, std::string>> diffs;
+        auto now = std::chrono::steady_clock::now();
+
+        for (auto room = rooms.begin(); room != rooms.end();) {
+            RoomState& state = room->second;
+
+            for (auto it = state.typing_expiry.begin(); it != state.typing_expiry.end();) {
+                if (it->second <= now) {
+                    state.pending[it->first] = Status::Online;
+                    it = state.typing_expiry.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            std::string line;
+            for (const auto& entry : state.pending) {
+                auto published = state.published.find(entry.first);
+                Status previous = published == state.published.end() ? Status::Offline : published->second;
+                if (entry.second == previous) {
+                    continue;
+                }
+                line += " " + entry.first + ":" + status_name(entry.second);
+                if (entry.second == Status::Offline) {
+                    state.published.erase(published);
+                } else {
+                    state.published[entry.first] = entry.second;
+                }
+            }
+            state.pending.clear();
+
+            if (!line.empty()) {
+                diffs.emplace_back(room->first, "[presence] #" + room->first + line);
+            }
+            if (state.published.empty() && state.typing_expiry.empty() && state.sessions.empty()) {
+                room = rooms.erase(room);
+            } else {
+                ++room;
+            }
+        }
+        return diffs;
+    }
+};
+
+// SHA-256, used to name attachments by their content
+class Sha256 {
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t block_length;
+    uint64_t total_length;
+
+    static uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void transform(const unsigned char* data) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(data[i * 4]) << 24) | (uint32_t(data[i * 4 + 1]) << 16) |
+                   (uint32_t(data[i * 4 + 2]) << 8) | uint32_t(data[i * 4 + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+public:
+    Sha256() : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+               block_length(0), total_length(0) {}
+
+    void update(const unsigned char* data, size_t length) {
+        total_length += length;
+        while (length > 0) {
+            size_t take = std::min(length, sizeof(block) - block_length);
+            memcpy(block + block_length, data, take);
+            block_length += take;
+            data += take;
+            length -= take;
+            if (block_length == sizeof(block)) {
+                transform(block);
+                block_length = 0;
+            }
+        }
+    }
+
+    std::string hex_digest() {
+        uint64_t bits = total_length * 8;
+        unsigned char padding[72] = {0x80};
+        size_t pad = (block_length < 56 ? 56 : 120) - block_length;
+        for (int i = 0; i < 8; ++i) {
+            padding[pad + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(padding, pad + 8);
+
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (uint32_t word : state) {
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                hex.push_back(digits[(word >> shift) & 0xF]);
+            }
+        }
+        return hex;
+    }
+};
+
+// Content-addressed attachment store. Transfers use their own connections, so a
+// large upload or download never sits in front of chat messages. Uploads are
+// spliced from the socket into the file and read back once to hash them;
+// downloads are served with sendfile, so they never copy through user space.
+//
+// Upload:   "/upload KEY TOKEN SIZE\n" -> "OFFSET N\n", client sends bytes N..SIZE -> "OK HASH\n"
+// Download: "/download HASH [OFFSET [LENGTH]]\n" -> "SIZE TOTAL OFFSET LENGTH\n" + bytes
+//
+// KEY is issued to a logged-in chat session and revoked when it ends, so only
+// connected users can upload. TOKEN is chosen by the client and names the
+// partial file, so an interrupted upload resumes from the returned offset.
+// Completed uploads wait in unshared/ until a /share publishes them; unshared
+// files and partials untouched for their ttl are deleted. Partials may not
+// exceed partial_quota bytes or MAX_PARTIALS files, and everything on disk
+// together may not exceed store_quota.
+class AttachmentStore {
+private:
+    static constexpr size_t CHUNK = 1 << 20;
+    static constexpr int TRANSFER_TIMEOUT_SEC = 30;
+    static constexpr size_t MAX_PARTIALS = 1024;
+
+    std::string directory;
+    uint64_t max_size;
+    uint64_t partial_quota;
+    uint64_t store_quota;
+    std::chrono::seconds partial_ttl;
+    std::chrono::seconds unshared_ttl;
+    std::map<std::string, uint64_t> active_uploads; // token -> declared size
+    std::set<std::string> upload_keys;
+    uint64_t store_used;                            // bytes in shared and unshared files
+    std::mutex uploads_mutex;
+
+public:
+    AttachmentStore(const std::string& directory, uint64_t max_size,
+                    uint64_t partial_quota = 4ULL << 30,
+                    uint64_t store_quota = 16ULL << 30,
+                    std::chrono::seconds partial_ttl = std::chrono::hours(24),
+                    std::chrono::seconds unshared_ttl = std::chrono::hours(24))
+        : directory(directory), max_size(max_size), partial_quota(partial_quota), store_quota(store_quota),
+          partial_ttl(partial_ttl), unshared_ttl(unshared_ttl), store_used(0) {
+        mkdir(directory.c_str(), 0755);
+        mkdir((directory + "/tmp").c_str(), 0755);
+        mkdir((directory + "/unshared").c_str(), 0755);
+        store_used = directory_size(directory) + directory_size(directory + "/unshared");
+    }
+
+    // Issues an upload key for a logged-in session
+    std::string issue_key() {
+        static const char digits[] = "0123456789abcdef";
+        std::random_device random;
+        std::string key;
+        for (int i = 0; i < 4; ++i) {
+            uint32_t word = random();
+            for (int shift = 28; shift >= 0; shift -= 4) {
+                key.push_back(digits[(word >> shift) & 0xF]);
+            }
+        }
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        upload_keys.insert(key);
+        return key;
+    }
+
+    void revoke_key(const std::string& key) {
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        upload_keys.erase(key);
+    }
+
+    // Publishes a completed upload; returns its size, or -1 if there is none
+    int64_t share(const std::string& hash) {
+        if (!is_hash(hash)) {
+            return -1;
+        }
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        struct stat info;
+        if (stat(path_for(hash).c_str(), &info) != 0 &&
+            (rename(unshared_path_for(hash).c_str(), path_for(hash).c_str()) != 0 ||
+             stat(path_for(hash).c_str(), &info) != 0)) {
+            return -1;
+        }
+        return info.st_size;
+    }
+
+    static bool is_transfer_request(const std::string& header) {
+        return header.compare(0, 8, "/upload ") == 0 || header.compare(0, 10, "/download ") == 0;
+    }
+
+    // Runs on the connection's own thread; the caller closes the socket
+    void serve(int client_socket, const std::string& header) {
+        struct timeval timeout = {TRANSFER_TIMEOUT_SEC, 0};
+        setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::istringstream in(header);
+        std::string command;
+        in >> command;
+        if (command == "/upload") {
+            std::string key;
+            std::string token;
+            uint64_t size = 0;
+            in >> key >> token >> size;
+            handle_upload(client_socket, key, token, size);
+        } else {
+            std::string hash;
+            uint64_t offset = 0;
+            uint64_t length = UINT64_MAX;
+            in >> hash >> offset >> length;
+            handle_download(client_socket, hash, offset, length);
+        }
+    }
+
+private:
+    void handle_upload(int client_socket, const std::string& key, const std::string& token, uint64_t size) {
+        if (!is_token(token) || size == 0 || size > max_size) {
+            reply(client_socket, "ERR invalid upload\n");
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(uploads_mutex);
+            if (!upload_keys.count(key)) {
+                reply(client_socket, "ERR not logged in\n");
+                return;
+            }
+            if (active_uploads.count(token)) {
+                reply(client_socket, "ERR upload already in progress\n");
+                return;
+            }
+            if (!reserve_partial(token, size)) {
+                reply(client_socket, "ERR upload quota exceeded\n");
+                return;
+            }
+            active_uploads[token] = size;
+        }
+
+        std::string partial = directory + "/tmp/" + token;
+        int fd = open(partial.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            off_t offset = lseek(fd, 0, SEEK_END);
+            bool complete = false;
+            if (static_cast<uint64_t>(offset) > size) {
+                offset = ftruncate(fd, 0) == 0 ? lseek(fd, 0, SEEK_SET) : -1;
+            }
+
+            if (offset < 0) {
+                reply(client_socket, "ERR store failed\n");
+            } else {
+                reply(client_socket, "OFFSET " + std::to_string(offset) + "\n");
+                complete = receive_into(client_socket, fd, size - offset);
+            }
+            close(fd);
+
+            if (complete) {
+                std::string hash = hash_file(partial);
+                if (!hash.empty() && store_completed(partial, hash, size)) {
+                    reply(client_socket, "OK " + hash + "\n");
+                } else {
+                    unlink(partial.c_str());
+                    reply(client_socket, "ERR store failed\n");
+                }
+            }
+        } else {
+            reply(client_socket, "ERR store failed\n");
+        }
+
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        active_uploads.erase(token);
+    }
+
+    // Moves a finished partial into unshared/, unless the content is already stored
+    bool store_completed(const std::string& partial, const std::string& hash, uint64_t size) {
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        struct stat info;
+        if (stat(path_for(hash).c_str(), &info) == 0) {
+            unlink(partial.c_str());
+            return true;
+        }
+        bool replaces = stat(unshared_path_for(hash).c_str(), &info) == 0;
+        if (rename(partial.c_str(), unshared_path_for(hash).c_str()) != 0) {
+            return false;
+        }
+        if (!replaces) {
+            store_used += size;
+        }
+        return true;
+    }
+
+    // Deletes expired partials and unshared uploads, then checks that another
+    // upload of `size` bytes fits both quotas. Active uploads count at their
+    // declared size, so concurrent uploads cannot overshoot them. Caller holds
+    // uploads_mutex.
+    bool reserve_partial(const std::string& token, uint64_t size) {
+        expire_unshared();
+
+        std::string tmp = directory + "/tmp";
+        DIR* dir = opendir(tmp.c_str());
+        if (!dir) {
+            return false;
+        }
+
+        time_t expiry = time(nullptr) - partial_ttl.count();
+        uint64_t used = 0;
+        size_t count = 0;
+        std::set<std::string> seen;
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            struct stat info;
+            std::string path = tmp + "/" + name;
+            if (name == token || !is_token(name) || stat(path.c_str(), &info) != 0) {
+                continue;
+            }
+            auto active = active_uploads.find(name);
+            if (active == active_uploads.end() && info.st_mtime < expiry) {
+                unlink(path.c_str());
+                continue;
+            }
+            used += active == active_uploads.end() ? info.st_size : std::max<uint64_t>(info.st_size, active->second);
+            ++count;
+            seen.insert(name);
+        }
+        closedir(dir);
+
+        // Uploads reserved but not yet created on disk
+        for (const auto& active : active_uploads) {
+            if (!seen.count(active.first)) {
+                used += active.second;
+                ++count;
+            }
+        }
+
+        return count < MAX_PARTIALS && used + size <= partial_quota && store_used + used + size <= store_quota;
+    }
+
+    // Caller holds uploads_mutex
+    void expire_unshared() {
+        std::string unshared = directory + "/unshared";
+        DIR* dir = opendir(unshared.c_str());
+        if (!dir) {
+            return;
+        }
+        time_t expiry = time(nullptr) - unshared_ttl.count();
+        while (struct dirent* entry = readdir(dir)) {
+            std::string path = unshared + "/" + entry->d_name;
+            struct stat info;
+            if (is_hash(entry->d_name) && stat(path.c_str(), &info) == 0 && info.st_mtime < expiry &&
+                unlink(path.c_str()) == 0) {
+                store_used -= std::min<uint64_t>(store_used, info.st_size);
+            }
+        }
+        closedir(dir);
+    }
+
+    // Total size of the attachment files directly inside a directory
+    static uint64_t directory_size(const std::string& path) {
+        uint64_t total = 0;
+        DIR* dir = opendir(path.c_str());
+        if (!dir) {
+            return 0;
+        }
+        while (struct dirent* entry = readdir(dir)) {
+            struct stat info;
+            if (is_hash(entry->d_name) && stat((path + "/" + entry->d_name).c_str(), &info) == 0) {
+                total += info.st_size;
+            }
+        }
+        closedir(dir);
+        return total;
+    }
+
+    // socket -> pipe -> file, falling back to a copy where splice is unsupported
+    bool receive_into(int client_socket, int fd, uint64_t remaining) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == 0) {
+            while (remaining > 0) {
+                ssize_t in = splice(client_socket, nullptr, pipefd[1], nullptr,
+                                    std::min<uint64_t>(remaining, CHUNK), SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (in < 0 && errno == EINVAL && remaining > 0) {
+                    break;
+                }
+                if (in <= 0) {
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                    return false;
+                }
+                remaining -= in;
+                while (in > 0) {
+                    ssize_t out = splice(pipefd[0], nullptr, fd, nullptr, in, SPLICE_F_MOVE);
+                    if (out <= 0) {
+                        close(pipefd[0]);
+                        close(pipefd[1]);
+                        return false;
+                    }
+                    in -= out;
+                }
+            }
+            close(pipefd[0]);
+            close(pipefd[1]);
+        }
+
+        char buffer[64 * 1024];
+        while (remaining > 0) {
+            ssize_t in = recv(client_socket, buffer, std::min<uint64_t>(remaining, sizeof(buffer)), 0);
+            if (in <= 0 || write(fd, buffer, in) != in) {
+                return false;
+            }
+            remaining -= in;
+        }
+        return true;
+    }
+
+    void handle_download(int client_socket, const std::string& hash, uint64_t offset, uint64_t length) {
+        int fd = is_hash(hash) ? open(path_for(hash).c_str(), O_RDONLY | O_CLOEXEC) : -1;
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || offset > static_cast<uint64_t>(info.st_size)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            reply(client_socket, "ERR not found\n");
+            return;
+        }
+
+        uint64_t total = info.st_size;
+        length = std::min(length, total - offset);
+        reply(client_socket, "SIZE " + std::to_string(total) + " " + std::to_string(offset) + " " +
+                             std::to_string(length) + "\n");
+
+        off_t position = offset;
+        uint64_t remaining = length;
+        while (remaining > 0) {
+            ssize_t sent = sendfile(client_socket, fd, &position, std::min<uint64_t>(remaining, CHUNK));
+            if (sent <= 0) {
+                break;
+            }
+            remaining -= sent;
+        }
+        close(fd);
+    }
+
+    std::string hash_file(const std::string& path) const {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return "";
+        }
+        Sha256 sha;
+        unsigned char buffer[64 * 1024];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            sha.update(buffer, n);
+        }
+        close(fd);
+        return n < 0 ? "" : sha.hex_digest();
+    }
+
+    std::string path_for(const std::string& hash) const {
+        return directory + "/" + hash;
+    }
+
+    std::string unshared_path_for(const std::string& hash) const {
+        return directory + "/unshared/" + hash;
+    }
+
+    void reply(int client_socket, const std::string& line) const {
+        send(client_socket, line.c_str(), line.length(), MSG_NOSIGNAL);
+    }
+
+    static bool is_hash(const std::string& hash) {
+        return hash.size() == 64 && std::all_of(hash.begin(), hash.end(), [](unsigned char c) {
+            return std::isdigit(c) || (c >= 'a' && c <= 'f');
+        });
+    }
+
+    static bool is_token(const std::string& token) {
+        return !token.empty() && token.size() <= 64 && std::all_of(token.begin(), token.end(), [](unsigned char c) {
+            return std::isalnum(c) || c == '-' || c == '_';
+        });
+    }
+};
+
+// Which cores the server's threads may run on. Empty worker_cpus leaves
+// scheduling to the kernel.
+struct ThreadTopology {
+    std::vector<int> worker_cpus;
+    int accept_cpu = -1;
+
+    // Parses one CPU number in [0, CPU_SETSIZE)
+    static bool parse_cpu(const std::string& text, int& cpu) {
+        if (text.empty() || !std::all_of(text.begin(), text.end(), [](unsigned char c) { return std::isdigit(c); })) {
+            return false;
+        }
+        long value = std::strtol(text.c_str(), nullptr, 10);
+        if (text.size() > 5 || value >= CPU_SETSIZE) {
+            return false;
+        }
+        cpu = static_cast<int>(value);
+        return true;
+    }
+
+    // Parses a kernel-style CPU list such as "0-3,8,10-11"; false on malformed input
+    static bool parse_cpu_list(const std::string& list, std::vector<int>& cpus) {
+        cpus.clear();
+        std::istringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            size_t dash = range.find('-');
+            int first = 0;
+            int last = 0;
+            if (!parse_cpu(range.substr(0, dash), first) ||
+                !parse_cpu(dash == std::string::npos ? range : range.substr(dash + 1), last) ||
+                last < first) {
+                return false;
+            }
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        }
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+        return true;
+    }
+};
+
+// Places each connection's thread on a worker core. The preferred core is the
+// one that processed the connection's packets (SO_INCOMING_CPU), so the socket,
+// the thread and the memory it first touches stay on one core and NUMA node.
+// When that core is not a worker, the least loaded worker on the same node is
+// used. Worker cores outside the process's affinity mask are ignored.
+class CpuPlacement {
+private:
+    // From <linux/mempolicy.h>, which needs libnuma headers on some distributions
+    static constexpr int MPOL_LOCAL = 4;
+
+    ThreadTopology topology;
+    std::map<int, int> node_of_cpu;
+    std::map<int, int> connections_per_cpu; // worker cpu -> pinned connections
+    std::mutex placement_mutex;
+
+public:
+    explicit CpuPlacement(const ThreadTopology& topology) : topology(topology) {
+        for (int node = 0; node < 1024; ++node) {
+            std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            std::vector<int> cpus;
+            if (cpulist && std::getline(cpulist, list) && ThreadTopology::parse_cpu_list(list, cpus)) {
+                for (int cpu : cpus) {
+                    node_of_cpu[cpu] = node;
+                }
+            }
+        }
+
+        // Only cores this process may run on can be pinned to
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            CPU_ZERO(&allowed);
+        }
+        for (int cpu : this->topology.worker_cpus) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                connections_per_cpu[cpu] = 0;
+            } else {
+                std::cerr << "Ignoring worker cpu " << cpu << ": not available to this process" << std::endl;
+            }
+        }
+        if (this->topology.accept_cpu >= 0 && !CPU_ISSET(this->topology.accept_cpu, &allowed)) {
+            std::cerr << "Ignoring accept cpu " << this->topology.accept_cpu << ": not available to this process" << std::endl;
+            this->topology.accept_cpu = -1;
+        }
+    }
+
+    bool enabled() const {
+        return !connections_per_cpu.empty();
+    }
+
+    int accept_cpu() const {
+        return topology.accept_cpu;
+    }
+
+    // Worker cores that survived validation
+    std::vector<int> worker_cpus() const {
+        std::vector<int> cpus;
+        for (const auto& entry : connections_per_cpu) {
+            cpus.push_back(entry.first);
+        }
+        return cpus;
+    }
+
+    // Returns the chosen worker cpu, or -1 when pinning is disabled
+    int assign(int client_socket) {
+        if (!enabled()) {
+            return -1;
+        }
+
+        int incoming = -1;
+        socklen_t length = sizeof(incoming);
+        if (getsockopt(client_socket, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &length) != 0) {
+            incoming = -1;
+        }
+
+        std::lock_guard<std::mutex> lock(placement_mutex);
+        int chosen = -1;
+        if (connections_per_cpu.count(incoming)) {
+            chosen = incoming;
+        } else {
+            int node = node_of(incoming);
+            chosen = least_loaded([&](int cpu) { return node >= 0 && node_of(cpu) == node; });
+            if (chosen < 0) {
+                chosen = least_loaded([](int) { return true; });
+            }
+        }
+        ++connections_per_cpu[chosen];
+        return chosen;
+    }
+
+    void release(int cpu) {
+        if (cpu < 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(placement_mutex);
+        --connections_per_cpu[cpu];
+    }
+
+    // Pins the calling thread. Combined with the kernel's first-touch placement,
+    // memory the thread allocates afterwards comes from that core's node; the
+    // explicit MPOL_LOCAL keeps that true if the process default policy differs.
+    static void pin_current_thread(int cpu) {
+        if (cpu < 0) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            std::cerr << "Failed to pin thread to cpu " << cpu << std::endl;
+            return;
+        }
+        // Fails harmlessly on kernels without NUMA support
+        syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0);
+    }
+
+private:
+    int node_of(int cpu) const {
+        auto it = node_of_cpu.find(cpu);
+        return it == node_of_cpu.end() ? -1 : it->second;
+    }
+
+    // Caller holds placement_mutex
+    template <typename Predicate>
+    int least_loaded(Predicate eligible) const {
+        int best = -1;
+        for (const auto& entry : connections_per_cpu) {
+            if (eligible(entry.first) && (best < 0 || entry.second < connections_per_cpu.at(best))) {
+                best = entry.first;
+            }
+        }
+        return best;
+    }
+};
+
+// Fixed-size pool where each worker owns a task deque. Workers run their own
+// tasks oldest first and steal the newest tasks from other workers when idle.
+// Tasks submitted from a worker go to the back of that worker's deque, so a
+// task that resubmits itself waits behind everything queued before it.
+class WorkStealingPool {
+private:
+    struct Worker {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_worker{0};
+    std::atomic<size_t> queued{0};
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool stopping;
+
+    static thread_local WorkStealingPool* current_pool;
+    static thread_local size_t current_index;
+
+public:
+    // With cpus given, one worker is pinned to each of them; otherwise
+    // thread_count unpinned workers are started
+    explicit WorkStealingPool(size_t thread_count, const std::vector<int>& cpus = {}) : stopping(false) {
+        thread_count = cpus.empty() ? std::max<size_t>(1, thread_count) : cpus.size();
+        for (size_t i = 0; i < thread_count; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < thread_count; ++i) {
+            threads.emplace_back(&WorkStealingPool::run, this, i, cpus.empty() ? -1 : cpus[i]);
+        }
+    }
+
+    ~WorkStealingPool() {
+        stop();
+    }
+
+    // Runs every queued task, then joins the workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        for (auto& thread : threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        size_t index = current_pool == this ? current_index : next_worker.fetch_add(1) % workers.size();
+        {
+            std::lock_guard<std::mutex> lock(workers[index]->mutex);
+            workers[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            queued.fetch_add(1);
+        }
+        sleep_cv.notify_one();
+    }
+
+private:
+    void run(size_t index, int cpu) {
+        CpuPlacement::pin_current_thread(cpu);
+        current_pool = this;
+        current_index = index;
+        std::function<void()> task;
+        while (true) {
+            if (take(index, task)) {
+                queued.fetch_sub(1);
+                task();
+                task = nullptr;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleep_cv.wait(lock, [this] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0) {
+                break;
+            }
+        }
+    }
+
+    bool take(size_t index, std::function<void()>& task) {
+        {
+            Worker& own = *workers[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < workers.size(); ++offset) {
+            Worker& victim = *workers[(index + offset) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+thread_local WorkStealingPool* WorkStealingPool::current_pool = nullptr;
+thread_local size_t WorkStealingPool::current_index = 0;
+
+// Staged processing between recv and fan-out. Filters can drop a message and
+// transforms can rewrite it; both run on the work-stealing pool so the I/O
+// threads only enqueue. Each room is a strand: at most one pool task drains a
+// room at a time, so messages in a room are delivered in the order received
+// while different rooms proceed in parallel. Stages must be registered before
+// the first submit.
+class MessagePipeline {
+public:
+    struct Message {
+        std::string room;
+        std::string username;
+        std::string text;
+        uint64_t sender_session; // never reused, unlike the socket descriptor
+        std::string attachment;  // "(SIZE bytes) HASH" for /share, empty for chat
+    };
+
+    using Filter = std::function<bool(const Message&)>;
+    using Transform = std::function<void(Message&)>;
+    using Sink = std::function<void(const Message&)>;
+
+private:
+    struct Stage {
+        std::string name;
+        std::function<bool(Message&)> process;
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+    };
+
+    struct RoomQueue {
+        std::deque<Message> pending;
+        bool scheduled = false;
+    };
+
+    // Messages a room task handles before yielding the worker to other rooms
+    static constexpr size_t ROOM_BATCH = 32;
+    static constexpr size_t MAX_IN_FLIGHT = 100000;
+
+    std::vector<std::unique_ptr<Stage>> stages;
+    Sink sink;
+    WorkStealingPool pool;
+
+    std::unordered_map<std::string, RoomQueue> rooms;
+    size_t in_flight;
+    std::mutex rooms_mutex;
+    std::condition_variable idle_cv;
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> abandoned{0};
+    std::atomic<std::chrono::steady_clock::rep> discard_after{std::chrono::steady_clock::time_point::max().time_since_epoch().count()};
+
+public:
+    // Pool workers run on cpus when given, so fan-out stays on the server's worker cores
+    MessagePipeline(Sink sink, const std::vector<int>& cpus = {})
+        : sink(std::move(sink)), pool(std::thread::hardware_concurrency(), cpus), in_flight(0) {}
+
+    void add_filter(const std::string& name, Filter filter) {
+        add_stage(name, [filter](Message& message) { return filter(message); });
+    }
+
+    void add_transform(const std::string& name, Transform transform) {
+        add_stage(name, [transform](Message& message) {
+            transform(message);
+            return true;
+        });
+    }
+
+    // Returns false when the pipeline is saturated and the message was dropped
+    bool submit(Message message) {
+        std::lock_guard<std::mutex> lock(rooms_mutex);
+        if (in_flight >= MAX_IN_FLIGHT) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        ++in_flight;
+        std::string room = message.room;
+        RoomQueue& queue = rooms[room];
+        queue.pending.push_back(std::move(message));
+        if (!queue.scheduled) {
+            queue.scheduled = true;
+            pool.submit([this, room] { drain_room(room); });
+        }
+        return true;
+    }
+
+    // Waits until every submitted message has been delivered or dropped
+    bool wait_idle(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(rooms_mutex);
+        return idle_cv.wait_until(lock, deadline, [this] { return in_flight == 0; });
+    }
+
+    // Messages not yet processed when the deadline passes are dropped; a stage
+    // already running is allowed to finish
+    void stop(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        discard_after.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+        pool.stop();
+    }
+
+    void print_stats() const {
+        for (const auto& stage : stages) {
+            uint64_t calls = stage->calls.load();
+            std::cout << "Stage " << stage->name << ": " << calls << " calls, "
+                      << stage->dropped.load() << " dropped, avg "
+                      << (calls ? stage->total_ns.load() / calls / 1000 : 0) << " us, max "
+                      << stage->max_ns.load() / 1000 << " us" << std::endl;
+        }
+        if (rejected.load() > 0) {
+            std::cout << "Pipeline rejected " << rejected.load() << " messages" << std::endl;
+        }
+        if (abandoned.load() > 0) {
+            std::cout << "Pipeline abandoned " << abandoned.load() << " messages at shutdown" << std::endl;
+        }
+    }
+
+private:
+    void add_stage(const std::string& name, std::function<bool(Message&)> process) {
+        auto stage = std::make_unique<Stage>();
+        stage->name = name;
+        stage->process = std::move(process);
+        stages.push_back(std::move(stage));
+    }
+
+    void drain_room(const std::string& room) {
+        for (size_t handled = 0;; ++handled) {
+            Message message;
+            {
+                std::lock_guard<std::mutex> lock(rooms_mutex);
+                if (handled > 0 && --in_flight == 0) {
+                    idle_cv.notify_all();
+                }
+                auto it = rooms.find(room);
+                if (it->second.pending.empty()) {
+                    rooms.erase(it);
+                    return;
+                }
+                if (handled == ROOM_BATCH) {
+                    // Stay scheduled but let other rooms use this worker
+                    pool.submit([this, room] { drain_room(room); });
+                    return;
+                }
+                message = std::move(it->second.pending.front());
+                it->second.pending.pop_front();
+            }
+            if (std::chrono::steady_clock::now().time_since_epoch().count() >=
+                discard_after.load(std::memory_order_relaxed)) {
+                abandoned.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            process(message);
+        }
+    }
+
+    void process(Message& message) {
+        for (const auto& stage : stages) {
+            auto start = std::chrono::steady_clock::now();
+            bool keep = stage->process(message);
+            uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+            stage->calls.fetch_add(1, std::memory_order_relaxed);
+            stage->total_ns.fetch_add(elapsed, std::memory_order_relaxed);
+            uint64_t max = stage->max_ns.load(std::memory_order_relaxed);
+            while (elapsed > max && !stage->max_ns.compare_exchange_weak(max, elapsed, std::memory_order_relaxed)) {
+            }
+            if (!keep) {
+                stage->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        sink(message);
+    }
+};
 
 class MessengerServer {
 private:
     int server_socket;
     int port;
-    std::map<int, std::string> clients; // socket -> username
+    struct ClientInfo {
+        std::string username;
+        std::string room;
+        uint64_t session_id;
+    };
+
+    // Closes the descriptor when the last holder lets go, so a broadcast that
+    // copied it out of clients_mutex never writes to a reused descriptor
+    struct ClientSocket {
+        int fd;
+        explicit ClientSocket(int fd) : fd(fd) {}
+        ~ClientSocket() { close(fd); }
+    };
+    struct RoomMember {
+        uint64_t session_id;
+        std::shared_ptr<ClientSocket> socket;
+    };
+
+    std::map<int, ClientInfo> clients; // socket -> client
+    std::unordered_map<std::string, std::map<int, RoomMember>> room_members; // room -> socket -> member
     std::mutex clients_mutex;
-    bool running;
-    std::vector<std::thread> client_threads;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> next_session_id{1}; // 0 means no sender
+    bool stopped;
+    std::thread accept_thread;
+    std::map<std::thread::id, std::thread> client_threads; // owned by the accept thread until stop()
+    std::vector<std::thread::id> finished_threads;         // handlers that have returned, not yet joined
+    std::set<int> connections; // every open client socket, chat or transfer
+    std::set<int> transfers;   // the subset carrying an upload or download
+    std::mutex connections_mutex;
+    std::condition_variable connections_cv;
+    RateLimiter rate_limiter;
+    SearchIndex search_index;
+    PresenceService presence;
+    AttachmentStore attachments;
+    CpuPlacement placement;
+    MessagePipeline pipeline;
+    std::chrono::steady_clock::time_point drain_deadline;
+
+    static constexpr const char* DEFAULT_ROOM = "general";
+    // Bounds how long a reply to a stalled reader can block that reader's own handler.
+    // Broadcasts never block; see broadcast_message.
+    static constexpr int SEND_TIMEOUT_SEC = 2;
 
 public:
-    MessengerServer(int port) : port(port), running(false) {}
+    MessengerServer(int port, const RateLimitConfig& rate_limits = RateLimitConfig(),
+                    const std::string& history_path = "history.log",
+                    const std::string& attachment_dir = "attachments",
+                    uint64_t max_attachment_size = 1ULL << 30,
+                    const ThreadTopology& topology = ThreadTopology())
+        : server_socket(-1), port(port), running(false), stopped(false), rate_limiter(rate_limits), search_index(history_path),
+          presence([this](const std::string& room, const std::string& diff) {
+              broadcast_message(diff, 0, room);
+          }),
+          attachments(attachment_dir, max_attachment_size),
+          placement(topology),
+          // Runs on pool workers, which is safe because broadcast_message never blocks
+          pipeline([this](const MessagePipeline::Message& message) {
+              broadcast_message(format_message(message), message.sender_session, message.room);
+          }, placement.worker_cpus()) {}
 
     ~MessengerServer() {
         stop();
     }
 
+    // Stages run in registration order, before the server's own archive stage.
+    // Register them before start().
+    void add_filter(const std::string& name, MessagePipeline::Filter filter) {
+        pipeline.add_filter(name, std::move(filter));
+    }
+
+    void add_transform(const std::string& name, MessagePipeline::Transform transform) {
+        pipeline.add_transform(name, std::move(transform));
+    }
+
     bool start() {
+        // Archive whatever survives the registered stages
+        pipeline.add_transform("archive", [this](MessagePipeline::Message& message) {
+            search_index.add(message.room, message.username,
+                             message.attachment.empty() ? message.text : format_message(message));
+        });
+
         // Create socket
         server_socket = socket(AF_INET, SOCK_STREAM, 0);
         if (server_socket == -1) {
@@ -62,42 +1907,93 @@ public:
         running = true;
 
         // Start the main connection acceptance loop
-        accept_connections();
+        accept_thread = std::thread(&MessengerServer::accept_connections, this);
         return true;
     }
 
-    void stop() {
+    // Graceful shutdown: stop accepting, tell clients where to go, let sessions
+    // finish within drain_timeout, then cut off whatever is left and flush state.
+    void stop(std::chrono::milliseconds drain_timeout = std::chrono::milliseconds(5000),
+              const std::string& reconnect_to = "") {
+        if (stopped) {
+            return;
+        }
+        stopped = true;
+        auto deadline = std::chrono::steady_clock::now() + drain_timeout;
+        drain_deadline = deadline; // published to handlers by the store to running
         running = false;
         
-        // Close server socket
+        // Wake accept() and stop taking connections
+        if (server_socket != -1) {
+            shutdown(server_socket, SHUT_RDWR);
+        }
+        if (accept_thread.joinable()) {
+            accept_thread.join();
+        }
         if (server_socket != -1) {
             close(server_socket);
+            server_socket = -1;
         }
         
-        // Close all client connections
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        for (const auto& client : clients) {
-            close(client.first);
+        // Notify chat clients, then end their input so handlers run their normal
+        // disconnect path. Output stays open so queued frames still go out.
+        // Transfers keep running until the deadline.
+        std::string notice = "[server] shutting down";
+        if (!reconnect_to.empty()) {
+            notice += ", reconnect to " + reconnect_to;
+        }
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            for (const auto& client : clients) {
+                send(client.first, notice.c_str(), notice.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            for (int client_socket : connections) {
+                if (!transfers.count(client_socket)) {
+                    shutdown(client_socket, SHUT_RD);
+                }
+            }
         }
-        clients.clear();
         
-        // Wait for all threads to finish
-        for (auto& thread : client_threads) {
-            if (thread.joinable()) {
-                thread.join();
+        // Wait for sessions and transfers to drain, then force the stragglers
+        {
+            std::unique_lock<std::mutex> lock(connections_mutex);
+            if (!connections_cv.wait_until(lock, deadline, [this] { return connections.empty(); })) {
+                std::cerr << connections.size() << " connection(s) did not drain in time, closing" << std::endl;
+                for (int client_socket : connections) {
+                    shutdown(client_socket, SHUT_RDWR);
+                }
             }
         }
         
+        // Every handler is now past any blocking call
+        for (auto& entry : client_threads) {
+            entry.second.join();
+        }
+        client_threads.clear();
+        
+        // Work still queued past the deadline is dropped: the pipeline discards
+        // undelivered messages and the index only persists pending history
+        pipeline.stop(deadline);
+        presence.stop();
+        search_index.stop(deadline);
+        
+        pipeline.print_stats();
+        rate_limiter.print_stats();
         std::cout << "Server stopped" << std::endl;
     }
 
 private:
     void accept_connections() {
+        CpuPlacement::pin_current_thread(placement.accept_cpu());
+        
         while (running) {
             struct sockaddr_in client_addr;
             socklen_t client_addr_len = sizeof(client_addr);
             
-            int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_addr_len);
+            int client_socket = accept4(server_socket, (struct sockaddr*)&client_addr, &client_addr_len, SOCK_CLOEXEC);
             if (client_socket < 0) {
                 if (running) {
                     std::cerr << "Error accepting connection" << std::endl;
@@ -110,33 +2006,123 @@ private:
             inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
             std::cout << "New connection from " << client_ip << ":" << ntohs(client_addr.sin_port) << std::endl;
             
-            // Create new thread for client handling
-            client_threads.push_back(std::thread(&MessengerServer::handle_client, this, client_socket));
+            // Refuse floods before spending a thread on them
+            auto address = rate_limiter.admit_connection(client_ip);
+            if (!address) {
+                std::cerr << "Connection from " << client_ip << " rejected by rate limiter" << std::endl;
+                close(client_socket);
+                continue;
+            }
+            
+            struct timeval send_timeout = {SEND_TIMEOUT_SEC, 0};
+            setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+            
+            // Register before the handler exists, so stop() always sees the connection
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                connections.insert(client_socket);
+            }
+            
+            // Create new thread for client handling, steered to the core that receives its packets
+            int cpu = placement.assign(client_socket);
+            try {
+                std::thread handler(&MessengerServer::handle_client, this, client_socket, address, cpu);
+                std::thread::id id = handler.get_id();
+                client_threads.emplace(id, std::move(handler));
+            } catch (const std::system_error& e) {
+                std::cerr << "Failed to start client thread: " << e.what() << std::endl;
+                placement.release(cpu);
+                rate_limiter.release_connection(address);
+                {
+                    std::lock_guard<std::mutex> lock(connections_mutex);
+                    connections.erase(client_socket);
+                }
+                connections_cv.notify_all();
+                close(client_socket);
+            }
+            
+            reap_client_threads();
+        }
+    }
+
+    // Joins handlers that have already returned, so their stacks are freed
+    // while the server runs rather than at stop()
+    void reap_client_threads() {
+        std::vector<std::thread::id> finished;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            finished.swap(finished_threads);
+        }
+        for (const auto& id : finished) {
+            auto it = client_threads.find(id);
+            if (it != client_threads.end()) {
+                it->second.join();
+                client_threads.erase(it);
+            }
+        }
+    }
+
+    void handle_client(int client_socket, std::shared_ptr<RateLimiter::AddressState> address, int cpu) {
+        // Pin before touching any session memory so it is allocated on the local node
+        CpuPlacement::pin_current_thread(cpu);
+        auto connection = std::make_shared<ClientSocket>(client_socket);
+        handle_session(connection, address);
+        placement.release(cpu);
+        rate_limiter.release_connection(address);
+        
+        // Unregister before closing so stop() never shuts down a reused descriptor
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex);
+            connections.erase(client_socket);
+            transfers.erase(client_socket);
+            finished_threads.push_back(std::this_thread::get_id());
         }
+        connections_cv.notify_all();
+        connection.reset(); // closes now, or when the last broadcast holding it finishes
     }
 
-    void handle_client(int client_socket) {
+    void handle_session(std::shared_ptr<ClientSocket> connection, std::shared_ptr<RateLimiter::AddressState> address) {
+        int client_socket = connection->fd;
         char buffer[1024];
         
         // Get username
         int bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
         if (bytes_read <= 0) {
-            close(client_socket);
             return;
         }
         
         buffer[bytes_read] = '\0';
+        
+        // Transfer connections carry one upload or download instead of a chat session
+        if (AttachmentStore::is_transfer_request(buffer)) {
+            {
+                std::lock_guard<std::mutex> lock(connections_mutex);
+                transfers.insert(client_socket);
+            }
+            attachments.serve(client_socket, buffer);
+            return;
+        }
+        
         std::string username(buffer);
+        RateLimiter::Session limits(rate_limiter, address);
+        std::string room = DEFAULT_ROOM;
+        PresenceService::Status status = PresenceService::Status::Online;
+        uint64_t session_id = next_session_id.fetch_add(1);
         
         // Add client to the list
         {
             std::lock_guard<std::mutex> lock(clients_mutex);
-            clients[client_socket] = username;
+            clients[client_socket] = ClientInfo{username, room, session_id};
+            room_members[room][client_socket] = RoomMember{session_id, connection};
         }
         
-        // Send connection notification
-        std::string connect_msg = username + " has joined the chat";
-        broadcast_message(connect_msg, client_socket);
+        // Uploads must present this key, so only logged-in users can store files
+        std::string upload_key = attachments.issue_key();
+        send_to(client_socket, "[upload-key] " + upload_key + "\n");
+        
+        // Announce through the next presence tick and show who is already here
+        presence.enter(room, username);
+        send_to(client_socket, presence.snapshot(room));
         
         // Main message processing loop
         while (running) {
@@ -145,52 +2131,278 @@ private:
                 break;
             }
             
+            // Enforce limits before any formatting or fan-out work
+            RateLimiter::Verdict verdict = rate_limiter.check_message(limits);
+            if (verdict == RateLimiter::Verdict::Disconnect) {
+                std::cerr << username << " disconnected for flooding" << std::endl;
+                break;
+            }
+            if (verdict == RateLimiter::Verdict::Drop) {
+                continue;
+            }
+            
             buffer[bytes_read] = '\0';
             std::string message(buffer);
             
-            // Format and send message to all clients
-            std::string formatted_msg = username + ": " + message;
-            broadcast_message(formatted_msg, client_socket);
+            if (message.compare(0, 7, "/search") == 0) {
+                handle_search(client_socket, message.substr(7));
+                continue;
+            }
+            if (message.compare(0, 6, "/join ") == 0) {
+                std::string new_room = message.substr(6);
+                new_room.erase(std::remove_if(new_room.begin(), new_room.end(),
+                                              [](unsigned char c) { return std::isspace(c); }),
+                               new_room.end());
+                if (!new_room.empty() && new_room != room) {
+                    presence.leave(room, username);
+                    {
+                        std::lock_guard<std::mutex> lock(clients_mutex);
+                        clients[client_socket].room = new_room;
+                        leave_room(client_socket, room);
+                        room_members[new_room][client_socket] = RoomMember{session_id, connection};
+                    }
+                    room = new_room;
+                    status = PresenceService::Status::Online;
+                    presence.enter(room, username);
+                    send_to(client_socket, presence.snapshot(room));
+                }
+                continue;
+            }
+            if (message.compare(0, 7, "/share ") == 0) {
+                handle_share(client_socket, session_id, username, room, message.substr(7));
+                continue;
+            }
+            if (message == "/away" || message == "/back" || message == "/typing") {
+                status = message == "/away" ? PresenceService::Status::Away
+                       : message == "/back" ? PresenceService::Status::Online
+                       : PresenceService::Status::Typing;
+                presence.update(room, username, status);
+                continue;
+            }
+            
+            // Sending a message ends typing or away
+            if (status != PresenceService::Status::Online) {
+                status = PresenceService::Status::Online;
+                presence.update(room, username, status);
+            }
+            
+            // Filtering, formatting and fan-out happen off this thread
+            submit_message(client_socket, {room, username, message, session_id, ""});
+        }
+        
+        // While draining, stay in the room until queued messages have been delivered
+        if (!running) {
+            pipeline.wait_idle(drain_deadline);
         }
         
         // Handle client disconnection
         {
             std::lock_guard<std::mutex> lock(clients_mutex);
-            std::string disconnect_msg = username + " has left the chat";
             clients.erase(client_socket);
-            broadcast_message(disconnect_msg, -1);
+            leave_room(client_socket, room);
+        }
+        presence.leave(room, username);
+        attachments.revoke_key(upload_key);
+    }
+
+    // /search [user:NAME] [room:NAME] [from:UNIX_TIME] [to:UNIX_TIME] [limit:N] words...
+    // Runs on the requesting client's thread and replies only to that client.
+    void handle_search(int client_socket, const std::string& args) {
+        SearchQuery query;
+        std::istringstream in(args);
+        std::string token;
+        while (in >> token) {
+            if (token.compare(0, 5, "user:") == 0) {
+                query.user = token.substr(5);
+            } else if (token.compare(0, 5, "room:") == 0) {
+                query.room = token.substr(5);
+            } else if (token.compare(0, 5, "from:") == 0) {
+                query.from_ms = std::atoll(token.c_str() + 5) * 1000;
+            } else if (token.compare(0, 3, "to:") == 0) {
+                query.to_ms = std::atoll(token.c_str() + 3) * 1000 + 999;
+            } else if (token.compare(0, 6, "limit:") == 0) {
+                query.limit = std::min<size_t>(std::max(1, std::atoi(token.c_str() + 6)), 100);
+            } else {
+                query.terms.push_back(token);
+            }
+        }
+
+        std::vector<SearchHit> hits = search_index.search(query);
+        std::string reply = "[search] " + std::to_string(hits.size()) + " result(s)";
+        for (const auto& hit : hits) {
+            char when[32];
+            time_t seconds = static_cast<time_t>(hit.timestamp_ms / 1000);
+            struct tm local;
+            localtime_r(&seconds, &local);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+            reply += "\n[search] " + std::string(when) + " #" + hit.room + " " + hit.user + ": " + hit.text;
+        }
+        send_to(client_socket, reply);
+    }
+
+    // /share HASH NAME announces an uploaded attachment to the room
+    void handle_share(int client_socket, uint64_t session_id, const std::string& username,
+                      const std::string& room, const std::string& args) {
+        std::istringstream in(args);
+        std::string hash;
+        std::string name;
+        in >> hash;
+        std::getline(in >> std::ws, name);
+
+        int64_t size = attachments.share(hash);
+        if (size < 0) {
+            send_to(client_socket, "[file] unknown attachment " + hash);
+            return;
+        }
+        // The name is user text, so it goes through the same stages as chat
+        submit_message(client_socket, {room, username, name, session_id,
+                                       "(" + std::to_string(size) + " bytes) " + hash});
+    }
+
+    void submit_message(int client_socket, MessagePipeline::Message message) {
+        if (!pipeline.submit(std::move(message))) {
+            send_to(client_socket, "[server] busy, message not delivered");
+        }
+    }
+
+    static std::string format_message(const MessagePipeline::Message& message) {
+        if (!message.attachment.empty()) {
+            return "[file] " + message.username + " shared " + message.text + " " + message.attachment;
+        }
+        return message.username + ": " + message.text;
+    }
+
+    void send_to(int client_socket, const std::string& message) {
+        send(client_socket, message.c_str(), message.length(), 0);
+    }
+
+    // Caller holds clients_mutex
+    void leave_room(int client_socket, const std::string& room) {
+        auto it = room_members.find(room);
+        if (it != room_members.end()) {
+            it->second.erase(client_socket);
+            if (it->second.empty()) {
+                room_members.erase(it);
+            }
         }
-        
-        close(client_socket);
     }
 
-    void broadcast_message(const std::string& message, int sender_socket) {
-        std::lock_guard<std::mutex> lock(clients_mutex);
+    // Visits only the room's members, so cost does not grow with other rooms.
+    // Recipients are copied out under clients_mutex and sent to without it.
+    // Sends never block: the kernel send buffer is each client's outbound
+    // queue, and a reader that lets it fill is disconnected instead of
+    // stalling the pipeline worker or presence thread that is fanning out.
+    void broadcast_message(const std::string& message, uint64_t sender_session, const std::string& room) {
+        std::vector<std::shared_ptr<ClientSocket>> recipients;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            auto members = room_members.find(room);
+            if (members != room_members.end()) {
+                for (const auto& member : members->second) {
+                    // Don't send message back to sender
+                    if (member.second.session_id != sender_session) {
+                        recipients.push_back(member.second.socket);
+                    }
+                }
+            }
+        }
         
         std::cout << message << std::endl;
         
-        for (const auto& client : clients) {
-            // Don't send message back to sender
-            if (client.first != sender_socket) {
-                send(client.first, message.c_str(), message.length(), 0);
+        for (const auto& recipient : recipients) {
+            ssize_t sent = send(recipient->fd, message.c_str(), message.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent != static_cast<ssize_t>(message.length())) {
+                // Its handler sees end of input and runs the normal disconnect path
+                shutdown(recipient->fd, SHUT_RDWR);
             }
         }
     }
 };
 
-int main() {
+static void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  --port N            listening port (default 8888)\n"
+              << "  --cpus LIST         worker cores, kernel-style list such as 0-3,8 (default: no pinning)\n"
+              << "  --accept-cpu N      core for the accept thread (default: no pinning)\n"
+              << "  --drain SECONDS     graceful shutdown deadline (default 5)\n"
+              << "  --reconnect ADDR    address clients are told to reconnect to on shutdown" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
     int port = 8888;
-    MessengerServer server(port);
+    ThreadTopology topology;
+    std::chrono::milliseconds drain_timeout(5000);
+    std::string reconnect_to;
+
+    // Process command line options
+    static const struct option options[] = {
+        {"port", required_argument, nullptr, 'p'},
+        {"cpus", required_argument, nullptr, 'c'},
+        {"accept-cpu", required_argument, nullptr, 'a'},
+        {"drain", required_argument, nullptr, 'd'},
+        {"reconnect", required_argument, nullptr, 'r'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+    int option;
+    while ((option = getopt_long(argc, argv, "p:c:a:d:r:h", options, nullptr)) != -1) {
+        char* end = nullptr;
+        bool valid = true;
+        switch (option) {
+            case 'p': {
+                long value = std::strtol(optarg, &end, 10);
+                valid = *optarg != '\0' && *end == '\0' && value > 0 && value <= 65535;
+                port = static_cast<int>(value);
+                break;
+            }
+            case 'c':
+                valid = ThreadTopology::parse_cpu_list(optarg, topology.worker_cpus);
+                break;
+            case 'a':
+                valid = ThreadTopology::parse_cpu(optarg, topology.accept_cpu);
+                break;
+            case 'd': {
+                double seconds = std::strtod(optarg, &end);
+                valid = *optarg != '\0' && *end == '\0' && seconds >= 0 && seconds <= 3600;
+                drain_timeout = std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
+                break;
+            }
+            case 'r':
+                reconnect_to = optarg;
+                break;
+            default:
+                valid = false;
+        }
+        if (!valid) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Block shutdown signals in every thread so only the sigwait below sees them
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+
+    MessengerServer server(port, RateLimitConfig(), "history.log", "attachments", 1ULL << 30, topology);
     
     if (!server.start()) {
         std::cerr << "Failed to start server" << std::endl;
         return 1;
     }
     
-    // Wait for Enter key to stop
-    std::cout << "Press Enter to stop the server..." << std::endl;
-    std::cin.get();
+    // Wait for SIGINT or SIGTERM to stop
+    std::cout << "Press Ctrl+C or send SIGTERM to stop the server..." << std::endl;
+    int received = 0;
+    sigwait(&shutdown_signals, &received);
+    std::cout << "Received " << strsignal(received) << ", draining" << std::endl;
     
-    server.stop();
+    server.stop(drain_timeout, reconnect_to);
     return 0;
 }